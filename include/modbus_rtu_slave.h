@@ -31,6 +31,50 @@ extern "C" {
     #define MBRS_STATISTICS_DIAGNOSTIC_START_ADDRESS 0xAA00
 #endif
 
+#ifndef MBRS_BATCH_CRC_LANES
+    // Number of frames whose CRC16 is calculated simultaneously in mbrs_process_batch. Independent lanes lets CPU overlap table lookups
+    #define MBRS_BATCH_CRC_LANES 4
+#endif
+
+#ifndef MBRS_PREFETCH_ENABLED
+    // Learn master polling schedule of read requests and call prefetch hook before predicted request. Costs RAM for staged data
+    #define MBRS_PREFETCH_ENABLED 0
+#endif
+
+#ifndef MBRS_PREFETCH_SLOTS
+    // Number of (function code, address, quantity) polling patterns tracked at the same time
+    #define MBRS_PREFETCH_SLOTS 4
+#endif
+
+#ifndef MBRS_PREFETCH_DATA_SIZE
+    // Max bytes of staged answer data per pattern, not more than 255
+    #define MBRS_PREFETCH_DATA_SIZE 64
+#endif
+
+#if MBRS_PREFETCH_DATA_SIZE > 255
+    #error "MBRS_PREFETCH_DATA_SIZE must not be more than 255"
+#endif
+
+#ifndef MBRS_PREFETCH_LEAD_TIME_MS
+    // How long before predicted request prefetch hook is called
+    #define MBRS_PREFETCH_LEAD_TIME_MS 5
+#endif
+
+#ifndef MBRS_PREFETCH_FRESHNESS_MS
+    // Staged data older than this is not used, read callback is called instead
+    #define MBRS_PREFETCH_FRESHNESS_MS 10
+#endif
+
+#ifndef MBRS_PREFETCH_JITTER_MS
+    // Two polling intervals that differ less than this are considered the same period
+    #define MBRS_PREFETCH_JITTER_MS 2
+#endif
+
+#ifndef MBRS_HOT_SWAP_ENABLED
+    // Support replacing context (address, callbacks) while reception goes on. Uses atomic builtins, may need libatomic on cores without them
+    #define MBRS_HOT_SWAP_ENABLED 0
+#endif
+
 #define MBRS_STAT_ANY_RECIEVED 0
 #define MBRS_STAT_MY_PACKETS_RECIEVED 1
 #define MBRS_STAT_OK_SENDED 2
@@ -98,6 +142,9 @@ typedef enum mbrs_protocol_error (mbrs_write_cb_t)(uint16_t address, uint16_t nu
 // Diagnostic function callback type
 typedef enum mbrs_protocol_error (mbrs_diagnostic_cb_t)(uint16_t subfunction, uint16_t data, uint16_t* return_data);
 
+// Prefetch hook type. Called before predicted read request, place answer to data* (not more than max_len bytes), length to data_len*
+typedef enum mbrs_protocol_error (mbrs_prefetch_cb_t)(uint8_t function_code, uint16_t address, uint16_t number_of_registers, uint8_t* data, uint8_t* data_len, uint8_t max_len);
+
 struct mbrs_context_t;
 
 struct mbrs_operation_t {
@@ -110,6 +157,15 @@ struct mbrs_operation_t {
     uint16_t tx_bytes;
     uint16_t tx_counter;
     uint16_t crc;
+
+    #if MBRS_HOT_SWAP_ENABLED == 1
+
+    // Context published by mbrs_publish_context, mbrs_process switches to it between frames
+    struct mbrs_context_t* pending_context;
+    // Replaced contexts, linked by retired_next, wait for mbrs_reclaim_context
+    struct mbrs_context_t* retired_contexts;
+
+    #endif
 };
 
 struct mbrs_context_t {
@@ -136,11 +192,63 @@ struct mbrs_context_t {
     }stat;
 
     #endif
+
+    #if MBRS_PREFETCH_ENABLED == 1
+
+    mbrs_prefetch_cb_t* prefetch_cb;
+
+    struct prefetch_t {
+        // Time of last mbrs_prefetch_tick call
+        uint32_t now_ms;
+        uint16_t hits;
+        uint16_t misses;
+
+        struct prefetch_slot_t {
+            uint8_t function_code;
+            uint16_t address;
+            uint16_t number_of_registers;
+            uint32_t last_request_ms;
+            // 0 - pattern is not learned yet
+            uint32_t period_ms;
+            bool confirmed;
+            bool staged;
+            uint32_t staged_ms;
+            uint8_t data_len;
+            uint8_t data[MBRS_PREFETCH_DATA_SIZE];
+        }slots[MBRS_PREFETCH_SLOTS];
+    }prefetch;
+
+    #endif
+
+    #if MBRS_HOT_SWAP_ENABLED == 1
+    struct mbrs_context_t* retired_next;
+    #endif
 };
 
 // Run modbus process
 enum mbrs_internal_error mbrs_process ( struct mbrs_operation_t* op );
 
+// Run modbus process over array of complete frames. Frames must not be passed through mbrs_input_byte, CRC is calculated here.
+// ret_codes - optional array of ops_count elements for result of each frame. Stops on critical error and returns it
+enum mbrs_internal_error mbrs_process_batch ( struct mbrs_operation_t* ops, uint16_t ops_count, enum mbrs_internal_error* ret_codes );
+
+#if MBRS_PREFETCH_ENABLED == 1
+// Update time and call prefetch hook for predicted requests of current context. Call it periodically, at least once per millisecond.
+// Call it from the same thread as mbrs_process (e.g. main loop), not from interrupt: prefetch state is not protected and hook may be slow
+void mbrs_prefetch_tick ( struct mbrs_operation_t* op, uint32_t now_ms );
+#endif
+
+#if MBRS_HOT_SWAP_ENABLED == 1
+// Publish new context (address, callbacks) without stopping reception. Safe to call from other thread or interrupt.
+// mbrs_process switches to it before next frame, statistics and learned prefetch patterns are carried over, staged prefetch data is not.
+// Returns previously published context that was not applied yet (it is free), or NULL.
+// Context can be published again only after it is reclaimed
+struct mbrs_context_t* mbrs_publish_context ( struct mbrs_operation_t* op, struct mbrs_context_t* context );
+
+// Returns one of replaced contexts that mbrs_process does not use anymore, or NULL. Call from one thread only
+struct mbrs_context_t* mbrs_reclaim_context ( struct mbrs_operation_t* op );
+#endif
+
 // Input byte from USART
 void mbrs_input_byte ( struct mbrs_operation_t* op, uint8_t data, enum mbrs_internal_error* where_put_ret_code );
 
@@ -2,6 +2,9 @@
 
 from mapyr import *
 
+# Optional library features are disabled by default, test build turns them on
+ALL_FEATURES_CFLAGS = ['-DMBRS_PREFETCH_ENABLED=1','-DMBRS_HOT_SWAP_ENABLED=1']
+
 def get_project(name:str) -> 'ProjectBase':
     if 'test' in name:
         import tests.mapyrfile
@@ -21,6 +24,9 @@ def get_project(name:str) -> 'ProjectBase':
     else:
         cfg.CFLAGS.extend(['-O3'])
 
+    if 'all-features' in name:
+        cfg.CFLAGS.extend(ALL_FEATURES_CFLAGS)
+
     project = c.Project('main','bin/libmodbus-rtu-slave.a',cfg)
 
     c.add_default_rules(project)
@@ -29,6 +29,7 @@
 #define WRITE_ANSWER_LEN 5
 #define DIAG_ANSWER_LEN 6
 #define ERROR_ANSWER_LEN 3
+#define CRC_LEN 2
 
 uint16_t mbrs_crc16_add ( uint8_t data, uint16_t crc ) {
     #if MBRS_CRC_TABLE_CALCULATION == 1
@@ -75,14 +76,122 @@ static void fill_error ( struct mbrs_operation_t* op, enum mbrs_protocol_error e
     #endif
 }
 
+#if MBRS_PREFETCH_ENABLED == 1
+
+// Find pattern of request and update its period. Unknown pattern replaces the least recently requested one
+static struct prefetch_slot_t* prefetch_learn ( struct mbrs_context_t* context, uint8_t function_code, uint16_t address, uint16_t number_of_registers ) {
+    uint32_t now = context->prefetch.now_ms;
+    struct prefetch_slot_t* oldest = &context->prefetch.slots[0];
+
+    for ( uint8_t slot_num = 0; slot_num < MBRS_PREFETCH_SLOTS; slot_num++ ) {
+        struct prefetch_slot_t* slot = &context->prefetch.slots[slot_num];
+
+        if ( (slot->function_code == function_code) and (slot->address == address) and (slot->number_of_registers == number_of_registers) ) {
+            uint32_t interval = now - slot->last_request_ms;
+            uint32_t diff = (interval > slot->period_ms) ? interval - slot->period_ms : slot->period_ms - interval;
+
+            slot->confirmed = (slot->period_ms != 0) and (diff < MBRS_PREFETCH_JITTER_MS);
+            slot->period_ms = interval;
+            slot->last_request_ms = now;
+            return slot;
+        }
+
+        if ( now - slot->last_request_ms > now - oldest->last_request_ms ) {
+            oldest = slot;
+        }
+    }
+
+    oldest->confirmed = false;
+    oldest->staged = false;
+    oldest->function_code = function_code;
+    oldest->address = address;
+    oldest->number_of_registers = number_of_registers;
+    oldest->last_request_ms = now;
+    oldest->period_ms = 0;
+    return oldest;
+}
+
+void mbrs_prefetch_tick ( struct mbrs_operation_t* op, uint32_t now_ms ) {
+    if ( not op ) {
+        return;
+    }
+
+    #if MBRS_HOT_SWAP_ENABLED == 1
+    struct mbrs_context_t* context = __atomic_load_n(&op->context, __ATOMIC_ACQUIRE);
+    #else
+    struct mbrs_context_t* context = op->context;
+    #endif
+
+    if ( not context ) {
+        return;
+    }
+
+    context->prefetch.now_ms = now_ms;
+
+    if ( not context->prefetch_cb ) {
+        return;
+    }
+
+    for ( uint8_t slot_num = 0; slot_num < MBRS_PREFETCH_SLOTS; slot_num++ ) {
+        struct prefetch_slot_t* slot = &context->prefetch.slots[slot_num];
+
+        if ( not slot->confirmed ) {
+            continue;
+        }
+
+        uint32_t since_request = now_ms - slot->last_request_ms;
+
+        // Master stopped polling this pattern
+        if ( since_request > 2 * slot->period_ms ) {
+            slot->confirmed = false;
+            slot->staged = false;
+            continue;
+        }
+
+        if ( slot->staged or (since_request + MBRS_PREFETCH_LEAD_TIME_MS < slot->period_ms) ) {
+            continue;
+        }
+
+        uint8_t data_len = 0;
+        enum mbrs_protocol_error error = context->prefetch_cb(slot->function_code, slot->address, slot->number_of_registers, slot->data, &data_len, MBRS_PREFETCH_DATA_SIZE);
+
+        // Only guards data_len reported by hook, data itself must fit max_len
+        if ( (error == MBRS_PROTOCOL_OK) and (data_len <= MBRS_PREFETCH_DATA_SIZE) ) {
+            slot->data_len = data_len;
+            slot->staged_ms = now_ms;
+            slot->staged = true;
+        }
+    }
+}
+
+#endif
+
 static enum mbrs_internal_error read( struct mbrs_operation_t* op, mbrs_read_cb_t* read_callback ) {
     if ( read_callback ) {
         uint16_t register_address = GET_VAL_BUF(op->rx_buffer_pointer,BN_REGISTER_ADDRESS);
         uint16_t number_of_registers = GET_VAL_BUF(op->rx_buffer_pointer,BN_NUMBER_OF_REGISTERS);
 
         uint8_t data_len = 0;
-
-        enum mbrs_protocol_error error = read_callback(register_address, number_of_registers, &op->tx_buffer_pointer[BN_READ_ANSWER_DATA], &data_len);
+        enum mbrs_protocol_error error;
+
+        #if MBRS_PREFETCH_ENABLED == 1
+        struct prefetch_slot_t* slot = prefetch_learn(op->context, op->rx_buffer_pointer[BN_FUNCTION_CODE], register_address, number_of_registers);
+
+        if ( slot->staged
+            and (op->context->prefetch.now_ms - slot->staged_ms <= MBRS_PREFETCH_FRESHNESS_MS)
+            and (READ_ANSWER_LEN_WITHOUT_DATA + slot->data_len + CRC_LEN <= op->tx_buffer_len) ) {
+            memcpy(&op->tx_buffer_pointer[BN_READ_ANSWER_DATA], slot->data, slot->data_len);
+            data_len = slot->data_len;
+            error = MBRS_PROTOCOL_OK;
+            op->context->prefetch.hits += 1;
+        } else {
+            error = read_callback(register_address, number_of_registers, &op->tx_buffer_pointer[BN_READ_ANSWER_DATA], &data_len);
+            op->context->prefetch.misses += 1;
+        }
+        slot->staged = false;
+        #else
+        error = read_callback(register_address, number_of_registers, &op->tx_buffer_pointer[BN_READ_ANSWER_DATA], &data_len);
+        #endif
 
         if ( error ) {
             fill_error(op, error);
@@ -130,6 +239,13 @@ static enum mbrs_internal_error write ( struct mbrs_operation_t* op, mbrs_write_
             //*(uint16_t*)&NUMBER_OF_REGISTERS(mb->tx_buffer_pointer) = *number_of_registers;
             memcpy(&op->tx_buffer_pointer[BN_REGISTER_ADDRESS], &op->rx_buffer_pointer[BN_REGISTER_ADDRESS], 4);
             op->tx_bytes = WRITE_ANSWER_LEN;
+
+            #if MBRS_PREFETCH_ENABLED == 1
+            // Staged data may contain written registers
+            for ( uint8_t slot_num = 0; slot_num < MBRS_PREFETCH_SLOTS; slot_num++ ) {
+                op->context->prefetch.slots[slot_num].staged = false;
+            }
+            #endif
         }
 
 
@@ -203,11 +319,68 @@ static enum mbrs_internal_error diagnostic( struct mbrs_operation_t* op ) {
     return MBRS_INTERNAL_OK;
 }
 
+#if MBRS_HOT_SWAP_ENABLED == 1
+
+// Called only between frames, so no frame sees two different contexts
+static void apply_pending_context ( struct mbrs_operation_t* op ) {
+    // Plain load on every frame, read-modify-write only when something is published
+    if ( not __atomic_load_n(&op->pending_context, __ATOMIC_ACQUIRE) ) {
+        return;
+    }
+
+    struct mbrs_context_t* pending = __atomic_exchange_n(&op->pending_context, NULL, __ATOMIC_ACQ_REL);
+    if ( not pending ) {
+        return;
+    }
+
+    struct mbrs_context_t* old = op->context;
+
+    if ( old ) {
+        #if MBRS_STATISTICS_ENABLED == 1
+        pending->stat = old->stat;
+        #endif
+
+        #if MBRS_PREFETCH_ENABLED == 1
+        pending->prefetch = old->prefetch;
+        // Staged data was fetched by hook of old context
+        for ( uint8_t slot_num = 0; slot_num < MBRS_PREFETCH_SLOTS; slot_num++ ) {
+            pending->prefetch.slots[slot_num].staged = false;
+        }
+        #endif
+    }
+
+    __atomic_store_n(&op->context, pending, __ATOMIC_RELEASE);
+
+    if ( old ) {
+        struct mbrs_context_t* head = __atomic_load_n(&op->retired_contexts, __ATOMIC_RELAXED);
+        do {
+            old->retired_next = head;
+        } while ( not __atomic_compare_exchange_n(&op->retired_contexts, &head, old, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+    }
+}
+
+struct mbrs_context_t* mbrs_publish_context ( struct mbrs_operation_t* op, struct mbrs_context_t* context ) {
+    return __atomic_exchange_n(&op->pending_context, context, __ATOMIC_ACQ_REL);
+}
+
+struct mbrs_context_t* mbrs_reclaim_context ( struct mbrs_operation_t* op ) {
+    // Only reclaimer removes contexts from list, so head stays valid until it is removed here
+    struct mbrs_context_t* head = __atomic_load_n(&op->retired_contexts, __ATOMIC_ACQUIRE);
+    while ( head and not __atomic_compare_exchange_n(&op->retired_contexts, &head, head->retired_next, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) ) {}
+    return head;
+}
+
+#endif
+
 enum mbrs_internal_error mbrs_process ( struct mbrs_operation_t* op ) {
     if ( not op ) {
         return MBRS_INTERNAL_ERROR_STRUCTURE_POINTER_IS_NULL;
     }
 
+    #if MBRS_HOT_SWAP_ENABLED == 1
+    apply_pending_context(op);
+    #endif
+
     if ( op->rx_bytes < MINIMAL_PACKET_LENGTH ) {
         #if MBRS_STATISTICS_ENABLED == 1
         op->context->stat.invalid_packets_recieved += 1;
@@ -292,6 +465,63 @@ enum mbrs_internal_error mbrs_process ( struct mbrs_operation_t* op ) {
     return error;
 }
 
+static void batch_crc16 ( struct mbrs_operation_t* ops, uint16_t lanes ) {
+    uint16_t crc[MBRS_BATCH_CRC_LANES];
+    uint16_t common_len = 0xFFFF;
+
+    for ( uint16_t lane = 0; lane < lanes; lane++ ) {
+        crc[lane] = 0xFFFF;
+        if ( ops[lane].rx_bytes < common_len ) {
+            common_len = ops[lane].rx_bytes;
+        }
+    }
+
+    // Interleave lanes over common part of frames. Each lane is independent chain of table lookups
+    for ( uint16_t byte_num = 0; byte_num < common_len; byte_num++ ) {
+        for ( uint16_t lane = 0; lane < lanes; lane++ ) {
+            crc[lane] = mbrs_crc16_add(ops[lane].rx_buffer_pointer[byte_num], crc[lane]);
+        }
+    }
+
+    // Tails
+    for ( uint16_t lane = 0; lane < lanes; lane++ ) {
+        for ( uint16_t byte_num = common_len; byte_num < ops[lane].rx_bytes; byte_num++ ) {
+            crc[lane] = mbrs_crc16_add(ops[lane].rx_buffer_pointer[byte_num], crc[lane]);
+        }
+        ops[lane].crc = crc[lane];
+    }
+}
+
+enum mbrs_internal_error mbrs_process_batch ( struct mbrs_operation_t* ops, uint16_t ops_count, enum mbrs_internal_error* ret_codes ) {
+    if ( not ops ) {
+        return MBRS_INTERNAL_ERROR_STRUCTURE_POINTER_IS_NULL;
+    }
+
+    for ( uint16_t op_num = 0; op_num < ops_count; op_num += MBRS_BATCH_CRC_LANES ) {
+        uint16_t lanes = ops_count - op_num;
+        if ( lanes > MBRS_BATCH_CRC_LANES ) {
+            lanes = MBRS_BATCH_CRC_LANES;
+        }
+
+        batch_crc16(&ops[op_num], lanes);
+
+        // Frames are processed in original order, because writes and reads of the same registers may follow each other
+        for ( uint16_t lane = 0; lane < lanes; lane++ ) {
+            enum mbrs_internal_error error = mbrs_process(&ops[op_num + lane]);
+
+            if ( ret_codes ) {
+                ret_codes[op_num + lane] = error;
+            }
+
+            if ( error > MBRS_INTERNAL_CRITICAL_LEVEL_ERRORS ) {
+                return error;
+            }
+        }
+    }
+
+    return MBRS_INTERNAL_OK;
+}
+
 void mbrs_input_byte ( struct mbrs_operation_t* op, uint8_t data, enum mbrs_internal_error* where_put_ret_code ) {
     if ( op->rx_bytes == 0 ) {
         op->crc = 0xFFFF;
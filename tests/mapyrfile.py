@@ -16,11 +16,16 @@ def get_project(name:str) -> 'ProjectBase':
     else:
         cfg.CFLAGS.extend(['-O3'])
 
+    libmodule = utils.get_module('../mapyrfile.py')
+
+    # Same flags for library and tests, they change structure layout
+    cfg.CFLAGS.extend(libmodule.ALL_FEATURES_CFLAGS)
+
     cfg.LIBS = ['stdc++','gtest','m']
 
     project = c.Project('test','bin/test',cfg)
 
-    libprj = utils.get_module('../mapyrfile.py').get_project('debug' if debug else 'release')
+    libprj = libmodule.get_project(('debug' if debug else 'release') + '-all-features')
     project.subprojects.append(libprj)
 
     c.add_default_rules(project)
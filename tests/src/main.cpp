@@ -1,6 +1,7 @@
 #include "gtest/gtest.h"
 
 #include "modbus_rtu_slave.h"
+#include "virtual_bus.h"
 
 const uint8_t test_data[] = {0x55,0x66};
 uint8_t test_registers[4];
@@ -176,6 +177,428 @@ TEST(MainTest, All) {
 
 }
 
+enum mbrs_protocol_error read_register_copy(uint16_t address, uint16_t number_of_registers, uint8_t* data, uint8_t* data_len){
+    if ( address != 0x1234 ) {
+        return MBRS_PROTOCOL_ERROR_DATA_ADDRESS;
+    };
+
+    memcpy(data,test_data,sizeof(test_data));
+    *data_len = sizeof(test_data);
+    return MBRS_PROTOCOL_OK;
+};
+
+enum mbrs_protocol_error write_register_copy(uint16_t address, uint16_t number_of_registers, uint8_t* data, uint16_t data_len) {
+    if ( address != 0x1234 ) {
+        return MBRS_PROTOCOL_ERROR_DATA_ADDRESS;
+    };
+
+    memcpy(&test_registers,data,data_len);
+    return MBRS_PROTOCOL_OK;
+};
+
+TEST(MainTest, Batch) {
+    uint8_t tx_arena[6][16];
+    uint8_t bad_crc[sizeof(read_holding_registers)];
+
+    memcpy(bad_crc, read_holding_registers, sizeof(bad_crc));
+    bad_crc[7] ^= 0xFF;
+
+    struct mbrs_context_t mb = {
+        .address = 1,
+        .read_holding_register_cb = read_register_copy,
+        .write_multiple_registers_cb = write_register_copy,
+    };
+
+    // Longer frame in the same lanes group as short ones
+    const uint8_t* frames[6] = {
+        read_holding_registers,
+        read_holding_registers_error,
+        bad_crc,
+        write_registers,
+        read_holding_registers,
+        diagnostic_stat,
+    };
+    const uint16_t frames_len[6] = {
+        sizeof(read_holding_registers),
+        sizeof(read_holding_registers_error),
+        sizeof(bad_crc),
+        sizeof(write_registers),
+        sizeof(read_holding_registers),
+        sizeof(diagnostic_stat),
+    };
+
+    struct mbrs_operation_t ops[6];
+    enum mbrs_internal_error ret_codes[6];
+
+    for ( uint8_t i=0; i < 6; i++){
+        ops[i] = (struct mbrs_operation_t){
+            .context=&mb,
+            .rx_buffer_pointer=(uint8_t*)frames[i],
+            .tx_buffer_pointer=tx_arena[i],
+            .tx_buffer_len = sizeof(tx_arena[i]),
+            .rx_bytes = frames_len[i],
+        };
+    }
+
+    EXPECT_EQ(mbrs_process_batch(ops, 6, ret_codes), MBRS_INTERNAL_OK);
+
+    EXPECT_EQ(ret_codes[0], MBRS_INTERNAL_OK);
+    EXPECT_EQ(ret_codes[1], MBRS_INTERNAL_ERROR_ANSWERED_ERROR);
+    EXPECT_EQ(ret_codes[2], MBRS_INTERNAL_ERROR_CRC);
+    EXPECT_EQ(ret_codes[3], MBRS_INTERNAL_OK);
+    EXPECT_EQ(ret_codes[4], MBRS_INTERNAL_OK);
+    EXPECT_EQ(ret_codes[5], MBRS_INTERNAL_OK);
+
+    for ( uint8_t i=0; i < 6; i++){
+        if ( ret_codes[i] != MBRS_INTERNAL_ERROR_CRC ) {
+            EXPECT_EQ(mbrs_crc16(ops[i].tx_buffer_pointer,ops[i].tx_bytes), 0);
+        }
+    }
+
+    EXPECT_EQ(ops[0].tx_bytes, 7);
+    EXPECT_EQ(ops[0].tx_buffer_pointer[3], test_data[0]);
+    EXPECT_EQ(ops[1].tx_buffer_pointer[1], 0x83);
+    EXPECT_EQ(ops[3].tx_buffer_pointer[1], 0x10);
+    EXPECT_EQ(test_registers[0], write_registers[7]);
+
+    // Statistics: any recieved counts all 6 frames, stat request is the last one
+    EXPECT_EQ(ops[5].tx_buffer_pointer[5], 6);
+}
+
+struct virtual_slave_t {
+    uint8_t rx_buffer[64];
+    uint8_t tx_buffer[64];
+    struct mbrs_context_t context;
+    struct mbrs_operation_t op;
+
+    explicit virtual_slave_t(uint8_t address) {
+        context = {};
+        context.address = address;
+        context.read_holding_register_cb = read_register_copy;
+
+        op = {};
+        op.context = &context;
+        op.rx_buffer_pointer = rx_buffer;
+        op.tx_buffer_pointer = tx_buffer;
+        op.rx_buffer_len = sizeof(rx_buffer);
+        op.tx_buffer_len = sizeof(tx_buffer);
+    }
+};
+
+static void make_read_request(uint8_t* frame, uint8_t address) {
+    memcpy(frame, read_holding_registers, sizeof(read_holding_registers));
+    frame[0] = address;
+    uint16_t crc = mbrs_crc16(frame, 6);
+    frame[6] = crc;
+    frame[7] = crc >> 8;
+}
+
+TEST(MainTest, VirtualBus) {
+    virtual_bus_config_t cfg;
+    cfg.baudrate = 9600;
+    cfg.direction_switch_ns = 10000;
+    cfg.master_timeout_ns = 20000000;
+
+    virtual_bus_t bus(cfg);
+    virtual_slave_t slave1(1), slave2(2), slave2_clone(2);
+
+    // 8E1 - 11 bits per char
+    EXPECT_EQ(bus.char_ns(), 11 * 1000000000ULL / 9600);
+    EXPECT_EQ(bus.t35_ns(), 11 * 1000000000ULL * 7 / 2 / 9600);
+
+    bus.add_slave(&slave1.op, 500000);
+    bus.add_slave(&slave2.op, 500000);
+
+    uint8_t request[8];
+    uint8_t response[64];
+
+    make_read_request(request, 1);
+    EXPECT_EQ(bus.poll(request, sizeof(request), response), 7);
+    EXPECT_EQ(mbrs_crc16(response, 7), 0);
+    EXPECT_EQ(response[3], test_data[0]);
+
+    make_read_request(request, 2);
+    EXPECT_EQ(bus.poll(request, sizeof(request), response), 7);
+    EXPECT_EQ(response[0], 2);
+
+    // Nobody with this address
+    make_read_request(request, 3);
+    EXPECT_EQ(bus.poll(request, sizeof(request), response), 0);
+    bus.run();
+
+    virtual_bus_report_t report = bus.report();
+    EXPECT_EQ(report.requests, 3);
+    EXPECT_EQ(report.responses, 2);
+    EXPECT_EQ(report.timeouts, 1);
+    EXPECT_EQ(report.collisions, 0);
+    EXPECT_EQ(report.max_turnaround_ns, bus.t35_ns() + 500000 + 10000);
+    EXPECT_EQ(report.min_turnaround_margin_ns, 20000000 - (int64_t)report.max_turnaround_ns);
+    EXPECT_GT(report.min_process_margin_ns, 0);
+    EXPECT_GT(report.utilization, 0);
+    EXPECT_LT(report.utilization, 1);
+
+    // Two slaves with the same address answer simultaneously
+    bus.add_slave(&slave2_clone.op, 500000);
+    make_read_request(request, 2);
+    EXPECT_EQ(bus.poll(request, sizeof(request), response), 7);
+    EXPECT_NE(mbrs_crc16(response, 7), 0);
+    bus.run();
+    EXPECT_EQ(bus.report().collisions, 1);
+}
+
+TEST(MainTest, VirtualBusPartialOverlap) {
+    virtual_bus_config_t cfg;
+    cfg.baudrate = 9600;
+    cfg.master_timeout_ns = 5000000;
+
+    virtual_bus_t bus(cfg);
+    virtual_slave_t slave1(1), slave2(2);
+
+    // Slave 1 answers after master timeout, during the last character of next request
+    bus.add_slave(&slave1.op, 10000000);
+    bus.add_slave(&slave2.op, 0);
+
+    uint8_t request1[8];
+    uint8_t request2[8];
+    make_read_request(request1, 1);
+    make_read_request(request2, 2);
+
+    uint8_t response[64];
+
+    EXPECT_EQ(bus.poll(request1, sizeof(request1)), 0);
+
+    // Master hears late answer of slave 1 with corrupted first character
+    EXPECT_EQ(bus.poll(request2, sizeof(request2), response), 7);
+    EXPECT_NE(mbrs_crc16(response, 7), 0);
+    for ( uint8_t i=1; i < 7; i++){
+        EXPECT_EQ(response[i], slave1.tx_buffer[i]);
+    }
+    bus.run();
+
+    EXPECT_EQ(bus.report().collisions, 1);
+    EXPECT_EQ(bus.report().timeouts, 1);
+
+    // Late answer is not a turnaround of request 2
+    EXPECT_EQ(bus.report().max_turnaround_ns, 0);
+    EXPECT_EQ(bus.report().min_turnaround_margin_ns, 5000000);
+
+    // Only overlapped character is corrupted
+    for ( uint8_t i=0; i < 7; i++){
+        EXPECT_EQ(slave2.rx_buffer[i], request2[i]);
+    }
+    EXPECT_NE(slave2.rx_buffer[7], request2[7]);
+    EXPECT_EQ(slave2.context.stat.my_packets_recieved, 0);
+}
+
+TEST(MainTest, VirtualBusHighBaudrate) {
+    virtual_bus_config_t cfg;
+    cfg.baudrate = 115200;
+    cfg.parity = false;
+    cfg.direction_switch_ns = 1000;
+    cfg.master_timeout_ns = 2000000;
+
+    virtual_bus_t bus(cfg);
+    virtual_slave_t slave1(1);
+
+    // 8N1 - 10 bits per char, t3.5 is fixed above 19200 baud
+    EXPECT_EQ(bus.char_ns(), 10 * 1000000000ULL / 115200);
+    EXPECT_EQ(bus.t35_ns(), 1750000);
+
+    bus.add_slave(&slave1.op, 200000);
+
+    uint8_t request[8];
+    make_read_request(request, 1);
+
+    for ( uint16_t i=0; i < 1000; i++){
+        EXPECT_EQ(bus.poll(request, sizeof(request)), 7);
+    }
+    bus.run();
+
+    // Turnaround 1.951 ms fits 2 ms timeout
+    virtual_bus_report_t report = bus.report();
+    EXPECT_EQ(report.responses, 1000);
+    EXPECT_EQ(report.collisions, 0);
+    EXPECT_EQ(report.max_turnaround_ns, 1750000 + 200000 + 1000);
+    EXPECT_EQ(report.min_turnaround_margin_ns, 2000000 - 1951000);
+    EXPECT_LT(report.min_process_margin_ns, 1750000);
+}
+
+#if MBRS_HOT_SWAP_ENABLED == 1
+
+TEST(MainTest, HotSwap) {
+    uint8_t tx_buffer[50];
+
+    struct mbrs_context_t mb1 = {
+        .address = 1,
+        .read_holding_register_cb = read_register_copy,
+    };
+    struct mbrs_context_t mb2 = {
+        .address = 2,
+        .read_holding_register_cb = read_register_copy,
+    };
+    struct mbrs_context_t mb3 = {
+        .address = 3,
+    };
+
+    struct mbrs_operation_t op = {
+        .context=&mb1,
+        .rx_buffer_pointer=(uint8_t*)read_holding_registers,
+        .tx_buffer_pointer=tx_buffer,
+        .tx_buffer_len = sizeof(tx_buffer),
+    };
+
+    op.rx_bytes = sizeof(read_holding_registers);
+    EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_OK);
+
+    // Superseded before applied, can be reused at once
+    EXPECT_EQ(mbrs_publish_context(&op, &mb3), nullptr);
+    EXPECT_EQ(mbrs_publish_context(&op, &mb2), &mb3);
+
+    // Still in use until next frame
+    EXPECT_EQ(mbrs_reclaim_context(&op), nullptr);
+    EXPECT_EQ(op.context, &mb1);
+
+    #if MBRS_PREFETCH_ENABLED == 1
+    mbrs_prefetch_tick(&op, 1000);
+    #endif
+
+    op.rx_bytes = sizeof(read_holding_registers);
+    EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_ERROR_ADDRESS_NOT_MATCH);
+    EXPECT_EQ(op.context, &mb2);
+
+    // Next swap does not wait for reclaim of previous one
+    EXPECT_EQ(mbrs_publish_context(&op, &mb3), nullptr);
+    op.rx_bytes = sizeof(read_holding_registers);
+    mbrs_process(&op);
+    EXPECT_EQ(op.context, &mb3);
+
+    EXPECT_EQ(mbrs_reclaim_context(&op), &mb2);
+    EXPECT_EQ(mbrs_reclaim_context(&op), &mb1);
+    EXPECT_EQ(mbrs_reclaim_context(&op), nullptr);
+
+    // Statistics are carried over
+    EXPECT_EQ(mb3.stat.any_recieved, 3);
+    EXPECT_EQ(mb3.stat.my_packets_recieved, 1);
+    EXPECT_EQ(mb3.stat.ok_sended, 1);
+
+    #if MBRS_PREFETCH_ENABLED == 1
+    // Prefetch state is carried over, tick goes to current context
+    EXPECT_EQ(mb3.prefetch.now_ms, 1000);
+    EXPECT_EQ(mb3.prefetch.slots[0].function_code, 0x03);
+    mbrs_prefetch_tick(&op, 1100);
+    EXPECT_EQ(mb3.prefetch.now_ms, 1100);
+    EXPECT_EQ(mb1.prefetch.now_ms, 1000);
+    #endif
+}
+
+#endif
+
+#if MBRS_PREFETCH_ENABLED == 1
+
+uint8_t prefetch_calls;
+const uint8_t prefetch_data[] = {0x77,0x88};
+
+enum mbrs_protocol_error prefetch(uint8_t function_code, uint16_t address, uint16_t number_of_registers, uint8_t* data, uint8_t* data_len, uint8_t max_len){
+    prefetch_calls += 1;
+    if ( max_len < sizeof(prefetch_data) ) {
+        return MBRS_PROTOCOL_ERROR_DEVICE_FAILURE;
+    }
+    memcpy(data,prefetch_data,sizeof(prefetch_data));
+    *data_len = sizeof(prefetch_data);
+    return MBRS_PROTOCOL_OK;
+}
+
+TEST(MainTest, Prefetch) {
+    uint8_t tx_buffer[50];
+
+    struct mbrs_context_t mb = {
+        .address = 1,
+        .read_holding_register_cb = read_register_copy,
+    };
+    mb.prefetch_cb = prefetch;
+
+    struct mbrs_operation_t op = {
+        .context=&mb,
+        .rx_buffer_pointer=(uint8_t*)read_holding_registers,
+        .tx_buffer_pointer=tx_buffer,
+        .tx_buffer_len = sizeof(tx_buffer),
+    };
+
+    // Master polls every 100 ms, pattern is confirmed after third request
+    for ( uint32_t now = 1000; now <= 1200; now += 100 ) {
+        mbrs_prefetch_tick(&op, now);
+        op.rx_bytes = sizeof(read_holding_registers);
+        EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_OK);
+        EXPECT_EQ(tx_buffer[3], test_data[0]);
+    }
+    EXPECT_EQ(prefetch_calls, 0);
+
+    // Too early for prefetch
+    mbrs_prefetch_tick(&op, 1290);
+    EXPECT_EQ(prefetch_calls, 0);
+
+    // Lead time before predicted request
+    mbrs_prefetch_tick(&op, 1296);
+    mbrs_prefetch_tick(&op, 1297);
+    EXPECT_EQ(prefetch_calls, 1);
+
+    // Served from staged data
+    mbrs_prefetch_tick(&op, 1300);
+    op.rx_bytes = sizeof(read_holding_registers);
+    EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_OK);
+    EXPECT_EQ(mbrs_crc16(op.tx_buffer_pointer,op.tx_bytes), 0);
+    EXPECT_EQ(tx_buffer[3], prefetch_data[0]);
+    EXPECT_EQ(mb.prefetch.hits, 1);
+
+    // Staged data gets stale, master is late. Fallback to read callback
+    mbrs_prefetch_tick(&op, 1396);
+    EXPECT_EQ(prefetch_calls, 2);
+    mbrs_prefetch_tick(&op, 1396 + MBRS_PREFETCH_FRESHNESS_MS + 1);
+    op.rx_bytes = sizeof(read_holding_registers);
+    EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_OK);
+    EXPECT_EQ(tx_buffer[3], test_data[0]);
+    EXPECT_EQ(mb.prefetch.hits, 1);
+
+    // Late request breaks period, it is confirmed again
+    for ( uint32_t now = 1507; now <= 1607; now += 100 ) {
+        mbrs_prefetch_tick(&op, now);
+        op.rx_bytes = sizeof(read_holding_registers);
+        EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_OK);
+    }
+
+    // Staged answer does not fit tx buffer. Fallback to read callback
+    mbrs_prefetch_tick(&op, 1703);
+    EXPECT_EQ(prefetch_calls, 3);
+    // Room only for 1 byte of data
+    op.tx_buffer_len = 4;
+    mbrs_prefetch_tick(&op, 1707);
+    op.rx_bytes = sizeof(read_holding_registers);
+    EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_ERROR_ANSWERED_ERROR);
+    EXPECT_EQ(mb.prefetch.hits, 1);
+
+    // Staged data fits, but CRC does not
+    mbrs_prefetch_tick(&op, 1803);
+    EXPECT_EQ(prefetch_calls, 4);
+    op.tx_buffer_len = 6;
+    mbrs_prefetch_tick(&op, 1807);
+    op.rx_bytes = sizeof(read_holding_registers);
+    mbrs_process(&op);
+    EXPECT_EQ(mb.prefetch.hits, 1);
+
+    // Answer with CRC fits exactly
+    mbrs_prefetch_tick(&op, 1903);
+    EXPECT_EQ(prefetch_calls, 5);
+    op.tx_buffer_len = 7;
+    mbrs_prefetch_tick(&op, 1907);
+    op.rx_bytes = sizeof(read_holding_registers);
+    EXPECT_EQ(mbrs_process(&op), MBRS_INTERNAL_OK);
+    EXPECT_EQ(op.tx_bytes, 7);
+    EXPECT_EQ(tx_buffer[3], prefetch_data[0]);
+    EXPECT_EQ(mb.prefetch.hits, 2);
+}
+
+#endif
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,276 @@
+#include "virtual_bus.h"
+
+#include <algorithm>
+#include <chrono>
+
+#define NS_IN_SECOND 1000000000ULL
+
+// Above 19200 baud t3.5 is fixed by specification
+#define T35_FIXED_BAUDRATE 19200
+#define T35_FIXED_NS 1750000ULL
+
+#define MASTER_NODE -1
+
+virtual_bus_t::virtual_bus_t ( const virtual_bus_config_t& cfg ) : config(cfg) {
+    uint32_t bits = 1 + config.data_bits + (config.parity ? 1 : 0) + config.stop_bits;
+
+    char_time = bits * NS_IN_SECOND / config.baudrate;
+
+    if ( config.baudrate > T35_FIXED_BAUDRATE ) {
+        t35_time = T35_FIXED_NS;
+    } else {
+        t35_time = bits * NS_IN_SECOND * 7 / 2 / config.baudrate;
+    }
+}
+
+void virtual_bus_t::add_slave ( struct mbrs_operation_t* op, uint64_t process_ns ) {
+    node_t node = {};
+    node.op = op;
+    node.process_ns = process_ns;
+    slaves.push_back(node);
+}
+
+void virtual_bus_t::schedule ( uint64_t time, event_type_t type, int node, int64_t transmission, uint8_t data, uint32_t token ) {
+    event_t ev = {};
+    ev.time = time;
+    ev.seq = seq++;
+    ev.type = type;
+    ev.node = node;
+    ev.transmission = transmission;
+    ev.data = data;
+    ev.token = token;
+    events.push(ev);
+}
+
+int64_t virtual_bus_t::transmit ( int node, uint64_t start, const uint8_t* data, uint16_t len ) {
+    // Pending bytes are not earlier than now, so a transmission ended one character before now
+    // neither overlaps them nor anything starting from now
+    while ( (not transmissions.empty()) and (transmissions.front().end + char_time <= now) ) {
+        transmissions.pop_front();
+        transmissions_base += 1;
+    }
+
+    transmission_t tr = {};
+    tr.node = node;
+    tr.start = start + config.direction_switch_ns;
+    tr.end = tr.start + len * char_time;
+
+    for ( transmission_t& other : transmissions ) {
+        if ( (other.node != node) and (other.start < tr.end) and (tr.start < other.end) ) {
+            if ( not tr.collided ) {
+                stat.collisions += 1;
+            }
+            other.collided = true;
+            tr.collided = true;
+        }
+    }
+
+    // Transmissions start in time order, so overlaps are only with the tail
+    if ( tr.end > busy_until ) {
+        stat.busy_ns += tr.end - ((tr.start > busy_until) ? tr.start : busy_until);
+        busy_until = tr.end;
+    }
+
+    node_t& sender = (node == MASTER_NODE) ? master : slaves[node];
+    sender.rx_off_from = start;
+    sender.rx_off_until = tr.end + config.direction_switch_ns;
+
+    transmissions.push_back(tr);
+    int64_t tr_num = transmissions_base + transmissions.size() - 1;
+
+    for ( uint16_t byte_num = 0; byte_num < len; byte_num++ ) {
+        uint64_t byte_end = tr.start + (byte_num + 1) * char_time;
+
+        if ( node != MASTER_NODE ) {
+            schedule(byte_end, EVENT_BYTE_RECIEVED, MASTER_NODE, tr_num, data[byte_num]);
+        }
+        for ( int slave_num = 0; slave_num < (int)slaves.size(); slave_num++ ) {
+            if ( slave_num != node ) {
+                schedule(byte_end, EVENT_BYTE_RECIEVED, slave_num, tr_num, data[byte_num]);
+            }
+        }
+    }
+
+    return tr_num;
+}
+
+bool virtual_bus_t::byte_collided ( int64_t id, uint64_t byte_end ) {
+    transmission_t& own = transmission(id);
+    if ( not own.collided ) {
+        return false;
+    }
+
+    uint64_t byte_start = byte_end - char_time;
+    for ( const transmission_t& other : transmissions ) {
+        if ( (other.node != own.node) and (other.start < byte_end) and (byte_start < other.end) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void virtual_bus_t::deliver ( int node, uint8_t data, uint64_t time ) {
+    node_t& receiver = (node == MASTER_NODE) ? master : slaves[node];
+
+    // Half-duplex: own driver is enabled
+    if ( (time >= receiver.rx_off_from) and (time < receiver.rx_off_until) ) {
+        return;
+    }
+
+    // Overlapped characters of collided transmissions are one garbage character for receiver
+    if ( (receiver.last_rx_ns != 0) and (time < receiver.last_rx_ns + char_time) ) {
+        return;
+    }
+
+    receiver.last_rx_ns = time;
+    receiver.rx_token += 1;
+
+    if ( node == MASTER_NODE ) {
+        if ( master_rx.empty() ) {
+            master_rx_start = time - char_time;
+        }
+        master_rx.push_back(data);
+    } else {
+        mbrs_input_byte(receiver.op, data, nullptr);
+    }
+
+    schedule(time + t35_time, EVENT_SILENCE, node, -1, 0, receiver.rx_token);
+}
+
+void virtual_bus_t::handle ( const event_t& ev ) {
+    switch ( ev.type ) {
+        case EVENT_BYTE_RECIEVED: {
+            uint8_t data = ev.data;
+            // Receiver gets garbage when two drivers are enabled during this character
+            if ( byte_collided(ev.transmission, ev.time) ) {
+                data = ~data;
+            }
+            deliver(ev.node, data, ev.time);
+            break;
+        }
+
+        case EVENT_SILENCE: {
+            if ( ev.node == MASTER_NODE ) {
+                if ( ev.token == master.rx_token ) {
+                    master_rx_done = true;
+                }
+                break;
+            }
+
+            node_t& slave = slaves[ev.node];
+            if ( (ev.token != slave.rx_token) or (slave.op->rx_bytes == 0) ) {
+                break;
+            }
+
+            uint64_t process_ns = slave.process_ns;
+            auto begin = std::chrono::steady_clock::now();
+            mbrs_process(slave.op);
+            if ( process_ns == 0 ) {
+                process_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            }
+
+            if ( process_ns > stat.max_process_ns ) {
+                stat.max_process_ns = process_ns;
+            }
+
+            if ( slave.op->tx_bytes ) {
+                schedule(ev.time + process_ns, EVENT_TX_START, ev.node);
+            }
+            break;
+        }
+
+        case EVENT_TX_START: {
+            std::vector<uint8_t> frame;
+            enum mbrs_internal_error ec = MBRS_INTERNAL_OK;
+
+            for ( ;; ) {
+                uint8_t data = mbrs_output_byte(slaves[ev.node].op, &ec);
+                if ( ec != MBRS_INTERNAL_OK ) {
+                    break;
+                }
+                frame.push_back(data);
+            }
+
+            transmit(ev.node, ev.time, frame.data(), frame.size());
+            break;
+        }
+
+    }
+}
+
+bool virtual_bus_t::step () {
+    if ( events.empty() ) {
+        return false;
+    }
+
+    event_t ev = events.top();
+    events.pop();
+    now = ev.time;
+    handle(ev);
+    return true;
+}
+
+void virtual_bus_t::run () {
+    while ( step() ) {}
+}
+
+uint16_t virtual_bus_t::poll ( const uint8_t* frame, uint16_t len, uint8_t* response ) {
+    uint64_t start = (busy_until + t35_time > now) ? busy_until + t35_time : now;
+
+    master_rx.clear();
+    master_rx_done = false;
+    stat.requests += 1;
+
+    int64_t tr_num = transmit(MASTER_NODE, start, frame, len);
+    uint64_t request_end = transmission(tr_num).end;
+
+    // Broadcast: nobody answers, master only keeps turnaround delay
+    if ( frame[0] == 0 ) {
+        while ( (not events.empty()) and (events.top().time <= request_end + t35_time) ) {
+            step();
+        }
+        now = request_end + t35_time;
+        return 0;
+    }
+
+    uint64_t deadline = request_end + config.master_timeout_ns;
+
+    while ( not master_rx_done ) {
+        // Character started before deadline is still the answer
+        if ( master_rx.empty() and (events.empty() or (events.top().time > deadline + char_time)) ) {
+            now = std::max(now, deadline);
+            stat.timeouts += 1;
+            return 0;
+        }
+        if ( not step() ) {
+            break;
+        }
+    }
+
+    // Answer that started before end of request is a late answer to previous one, it is already counted as collision
+    if ( master_rx_start >= request_end ) {
+        uint64_t turnaround = master_rx_start - request_end;
+        if ( turnaround > stat.max_turnaround_ns ) {
+            stat.max_turnaround_ns = turnaround;
+        }
+    }
+    stat.responses += 1;
+
+    if ( response ) {
+        std::copy(master_rx.begin(), master_rx.end(), response);
+    }
+    return master_rx.size();
+}
+
+virtual_bus_report_t virtual_bus_t::report () const {
+    virtual_bus_report_t result = stat;
+
+    result.elapsed_ns = (now > busy_until) ? now : busy_until;
+    if ( result.elapsed_ns ) {
+        result.utilization = (double)result.busy_ns / result.elapsed_ns;
+    }
+    result.min_turnaround_margin_ns = (int64_t)config.master_timeout_ns - (int64_t)result.max_turnaround_ns;
+    result.min_process_margin_ns = (int64_t)t35_time - (int64_t)result.max_process_ns;
+
+    return result;
+}
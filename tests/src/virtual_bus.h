@@ -0,0 +1,137 @@
+#ifndef _VIRTUAL_BUS_H
+#define _VIRTUAL_BUS_H
+
+#include <deque>
+#include <queue>
+#include <vector>
+
+#include "modbus_rtu_slave.h"
+
+// Discrete-event model of half-duplex RS-485 segment: one master, many slaves.
+// Slaves are driven only through mbrs_input_byte / mbrs_process / mbrs_output_byte under simulated time.
+// All times are in nanoseconds.
+
+struct virtual_bus_config_t {
+    uint32_t baudrate = 9600;
+    uint8_t data_bits = 8;
+    bool parity = true;
+    uint8_t stop_bits = 1;
+
+    // Driver enable / disable time when node switches between receive and transmit
+    uint64_t direction_switch_ns = 0;
+
+    // Master waits response start not longer than this after end of request
+    uint64_t master_timeout_ns = 100000000;
+};
+
+struct virtual_bus_report_t {
+    uint64_t elapsed_ns = 0;
+    uint64_t busy_ns = 0;
+    double utilization = 0;
+
+    uint32_t requests = 0;
+    uint32_t responses = 0;
+    uint32_t timeouts = 0;
+    uint32_t collisions = 0;
+
+    // From end of request to start of response
+    uint64_t max_turnaround_ns = 0;
+    // master_timeout_ns - max_turnaround_ns
+    int64_t min_turnaround_margin_ns = 0;
+
+    // Longest mbrs_process with handlers, and how much of t3.5 is left after it
+    uint64_t max_process_ns = 0;
+    int64_t min_process_margin_ns = 0;
+};
+
+class virtual_bus_t {
+public:
+    explicit virtual_bus_t ( const virtual_bus_config_t& config );
+
+    // process_ns - simulated duration of mbrs_process with handlers. 0 - measure real duration on host
+    void add_slave ( struct mbrs_operation_t* op, uint64_t process_ns );
+
+    // Master sends frame after bus is idle for t3.5 and waits answer or timeout.
+    // Returns answer length, answer is placed to response (if not NULL)
+    uint16_t poll ( const uint8_t* frame, uint16_t len, uint8_t* response = nullptr );
+
+    // Let all pending events finish
+    void run ();
+
+    uint64_t char_ns () const { return char_time; }
+    uint64_t t35_ns () const { return t35_time; }
+    uint64_t now_ns () const { return now; }
+
+    virtual_bus_report_t report () const;
+
+private:
+    enum event_type_t {
+        EVENT_BYTE_RECIEVED,
+        EVENT_SILENCE,
+        EVENT_TX_START,
+    };
+
+    struct event_t {
+        uint64_t time;
+        uint64_t seq;
+        event_type_t type;
+        // -1 - master
+        int node;
+        int64_t transmission;
+        uint8_t data;
+        uint32_t token;
+
+        bool operator> ( const event_t& other ) const {
+            return (time != other.time) ? time > other.time : seq > other.seq;
+        }
+    };
+
+    struct transmission_t {
+        int node;
+        uint64_t start;
+        uint64_t end;
+        bool collided;
+    };
+
+    struct node_t {
+        struct mbrs_operation_t* op;
+        uint64_t process_ns;
+        // Receiver is off while driver is enabled
+        uint64_t rx_off_from;
+        uint64_t rx_off_until;
+        uint32_t rx_token;
+        uint64_t last_rx_ns;
+    };
+
+    void schedule ( uint64_t time, event_type_t type, int node, int64_t transmission = -1, uint8_t data = 0, uint32_t token = 0 );
+    int64_t transmit ( int node, uint64_t start, const uint8_t* data, uint16_t len );
+    transmission_t& transmission ( int64_t id ) { return transmissions[id - transmissions_base]; }
+    bool byte_collided ( int64_t id, uint64_t byte_end );
+    void handle ( const event_t& ev );
+    bool step ();
+    void deliver ( int node, uint8_t data, uint64_t time );
+
+    virtual_bus_config_t config;
+    uint64_t char_time;
+    uint64_t t35_time;
+    uint64_t now = 0;
+    uint64_t seq = 0;
+
+    std::priority_queue<event_t, std::vector<event_t>, std::greater<event_t>> events;
+    // Only transmissions that still can overlap new ones or have bytes on the way. Front has id transmissions_base
+    std::deque<transmission_t> transmissions;
+    int64_t transmissions_base = 0;
+    std::vector<node_t> slaves;
+    node_t master = {};
+
+    uint64_t busy_until = 0;
+
+    // Master receive state
+    std::vector<uint8_t> master_rx;
+    uint64_t master_rx_start = 0;
+    bool master_rx_done = false;
+
+    virtual_bus_report_t stat;
+};
+
+#endif